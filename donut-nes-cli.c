@@ -1,3 +1,5 @@
+#define _POSIX_C_SOURCE 200809L  /* sysconf() */
+
 /* Standard headers that do not require the C runtime */
 #include <stddef.h>
 #include <limits.h>
@@ -13,10 +15,13 @@
 #include "donut-nes.h"
 
 #include <stdio.h>   /* I/O */
+#include <inttypes.h> /* PRIu64 */
 #include <errno.h>   /* errno */
 #include <stdlib.h>  /* exit(), strtol() */
 #include <string.h>  /* memcpy() */
 #include <getopt.h>  /* getopt_long() */
+#include <unistd.h>  /* sysconf() */
+#include <pthread.h> /* pthread_create() */
 
 const char *PROGRAM_NAME = "donut-nes";
 const char *USAGE_TEXT =
@@ -24,19 +29,46 @@ const char *USAGE_TEXT =
 	"\n"
 	"Usage:\n"
 	"  donut-nes [-d] [options] INPUT [-o] OUTPUT\n"
+	"  donut-nes [-d] [options] --output-dir=DIR INPUT...\n"
+	"  donut-nes [-d] [options] --manifest < MANIFEST\n"
 	"\n"
 	"Options:\n"
 	"  -h, --help             show this help message and exit\n"
 	"  -z, --compress         compress input file [default action]\n"
 	"  -d, --decompress       decompress input file\n"
+	"  --retarget             re-pack the blocks of a compressed input file that\n"
+	"                         take longer to decode then --cycle-limit\n"
 	"  -o FILE, --output=FILE\n"
 	"                         output to FILE instead of second positional argument\n"
 	"  -c --stdout            use standard input/output when filenames are absent\n"
 	"  -f, --force            overwrite output without prompting\n"
 	"  -q, --quiet            suppress error messages\n"
 	"  -v, --verbose          show completion stats\n"
+	"  --group-tiles[=METRIC] reorder tiles into blocks to minimise the compressed\n"
+	"                         'size' [default] or the decoding 'cycles'\n"
+	"  --tile-map=FILE        with --group-tiles, write the new index of each\n"
+	"                         input tile to FILE as 16-bit little endian\n"
+	"  --ines                 compress each 8 KiB bank of the CHR-ROM in a .nes file\n"
+	"  --ines-region=OFFSET:LENGTH\n"
+	"                         with --ines, compress this region instead, where\n"
+	"                         OFFSET is from the start of PRG-ROM\n"
+	"  --bank-table=FILE      with --ines, write the output offset and compressed\n"
+	"                         size of each bank to FILE as pairs of 32-bit\n"
+	"                         little endian integers\n"
+	"  --output-dir=DIR       process each INPUT into DIR, named INPUT.donut when\n"
+	"                         compressing, without .donut (or with .chr added if\n"
+	"                         it has no .donut) when decompressing, or INPUT when\n"
+	"                         retargeting\n"
+	"  --manifest             read lines of INPUT<tab>OUTPUT from standard input,\n"
+	"                         or lines of INPUT with --output-dir\n"
+	"  -j N, --jobs=N         number of threads to use [default: all CPUs]\n"
 //	"  --no-bit-flip          don't encode bit rotated blocks\n"
-//	"  --cycle-limit INT      limits the 6502 decoding time for each encoded block\n"
+	"  --cycle-limit INT      limits the 6502 decoding time for each encoded block\n"
+	"                         with --retarget or --group-tiles\n"
+	"\n"
+	"With --output-dir or --manifest, existing outputs are skipped without error\n"
+	"unless --force is given. Inputs that would write the same output all fail,\n"
+	"and a file that fails doesn't stop the others.\n"
 ;
 
 static int verbosity_level = 0;
@@ -47,10 +79,15 @@ static void fatal_error(const char *msg)
 	exit(EXIT_FAILURE);
 }
 
-static void fatal_perror(const char *filename)
+static void report_perror(const char *filename)
 {
 	if (verbosity_level >= 0)
 		perror(filename);
+}
+
+static void fatal_perror(const char *filename)
+{
+	report_perror(filename);
 	exit(EXIT_FAILURE);
 }
 
@@ -60,6 +97,584 @@ static void fatal_perror(const char *filename)
 #define BUF_IO_SIZE 131072
 #define BUF_GAP_SIZE 512
 
+static uint8_t *read_entire_file(FILE *file, const char *filename, size_t *length)
+{
+	uint8_t *buffer = NULL;
+	size_t capacity = 0;
+	*length = 0;
+	while (!feof(file)) {
+		if (capacity - *length < BUF_IO_SIZE) {
+			capacity = capacity*2 + BUF_IO_SIZE;
+			buffer = realloc(buffer, capacity);
+			if (buffer == NULL) {
+				fatal_error("Out of memory.\n");
+			}
+		}
+		*length += fread(buffer + *length, sizeof(uint8_t), BUF_IO_SIZE, file);
+		if (ferror(file)) {
+			fatal_perror(filename);
+		}
+	}
+	return buffer;
+}
+
+static void print_stats(const char *filename, bool decompress, uint64_t total_bytes_in, uint64_t total_bytes_out)
+{
+	double total_bytes_ratio = 0.0;
+	if (decompress) {
+		if (total_bytes_out != 0) {
+			total_bytes_ratio = (1.0 - ((double)total_bytes_in / (double)total_bytes_out))*100.0;
+		}
+	} else {
+		if (total_bytes_in != 0) {
+			total_bytes_ratio = (1.0 - ((double)total_bytes_out / (double)total_bytes_in))*100.0;
+		}
+	}
+	fprintf (stderr, "%s :%#5.1f%% (%" PRIu64 " => %" PRIu64 " bytes)\n", filename, total_bytes_ratio, total_bytes_in, total_bytes_out);
+}
+
+// Compresses, decompresses or retargets all of 'input_file' into 'output_file'
+// through the two BUF_IO_SIZE+BUF_GAP_SIZE sized buffers.
+// bytes_not_processed: written with the number of trailing input bytes left over.
+// Returns: NULL on success, or the name of the file that had a I/O error.
+static const char *process_stream(FILE *input_file, const char *input_filename,
+	FILE *output_file, const char *output_filename, bool decompress, bool retarget, int cycle_limit,
+	uint8_t *input_buffer, uint8_t *output_buffer,
+	uint64_t *total_bytes_in, uint64_t *total_bytes_out, size_t *bytes_not_processed)
+{
+	size_t input_buffer_length = 0;
+	size_t output_buffer_length = 0;
+	size_t i, l = 0;
+	bool done = false;
+	while(1) {
+		if (!feof(input_file) && (input_buffer_length < BUF_GAP_SIZE)) {
+			l = fread(input_buffer + input_buffer_length, sizeof(uint8_t), BUF_IO_SIZE, input_file);
+			if (ferror(input_file)) {
+				return input_filename;
+			}
+			input_buffer_length += l;
+		}
+
+		if (decompress) {
+			l = donut_decompress_large(output_buffer + output_buffer_length, BUF_IO_SIZE+BUF_GAP_SIZE - output_buffer_length, input_buffer, input_buffer_length, &i);
+		} else if (retarget) {
+			l = donut_retarget(output_buffer + output_buffer_length, BUF_IO_SIZE+BUF_GAP_SIZE - output_buffer_length, input_buffer, input_buffer_length, &i, cycle_limit);
+		} else {
+			l = donut_compress_large(output_buffer + output_buffer_length, BUF_IO_SIZE+BUF_GAP_SIZE - output_buffer_length, input_buffer, input_buffer_length, &i);
+		}
+		*total_bytes_in += i;
+		*total_bytes_out += l;
+		output_buffer_length += l;
+		if ((l == 0) && (i == 0))
+			done = true;
+
+		if (input_buffer_length > i) {
+			memmove(input_buffer, input_buffer + i, input_buffer_length - i);
+		}
+		input_buffer_length -= i;
+
+		if (output_buffer_length >= BUF_IO_SIZE) {
+			l = fwrite(output_buffer, sizeof(uint8_t), BUF_IO_SIZE, output_file);
+			if (ferror(output_file)) {
+				return output_filename;
+			}
+			if (output_buffer_length > l) {
+				memmove(output_buffer, output_buffer + l, output_buffer_length - l);
+			}
+			output_buffer_length -= l;
+		}
+
+		if (done) {
+			if (output_buffer_length) {
+				fwrite(output_buffer, sizeof(uint8_t), output_buffer_length, output_file);
+				if (ferror(output_file)) {
+					return output_filename;
+				}
+			}
+			break;
+		}
+	}
+	*bytes_not_processed = input_buffer_length;
+	return NULL;
+}
+
+static void write_entire_file(FILE *file, const char *filename, const uint8_t *buffer, size_t length)
+{
+	fwrite(buffer, sizeof(uint8_t), length, file);
+	if (ferror(file)) {
+		fatal_perror(filename);
+	}
+}
+
+// Reads all of the input, reorders the tiles with donut_group_tiles(),
+// and writes the compressed blocks and the tile map.
+// Returns: the number of trailing input bytes that was not processed.
+static size_t group_tiles_and_compress(FILE *input_file, const char *input_filename,
+	FILE *output_file, const char *output_filename, const char *tile_map_filename,
+	int cycle_limit, bool least_cycles, uint64_t *total_bytes_in, uint64_t *total_bytes_out)
+{
+	size_t input_length, output_length, i;
+	uint8_t *input = read_entire_file(input_file, input_filename, &input_length);
+	int tile_count = (input_length / 64) * 4;
+	if (input_length / 64 > 65536 / 4) {
+		fatal_error("--group-tiles supports at most 65536 tiles.\n");
+	}
+
+	int *tile_order = malloc(sizeof(int) * (tile_count + 1));
+	uint8_t *grouped = malloc(tile_count*16 + 1);
+	uint8_t *tile_map = malloc(tile_count*2 + 1);
+	uint8_t *output = malloc(donut_compress_bound(tile_count*16) + 1);
+	if ((tile_order == NULL) || (grouped == NULL) || (tile_map == NULL) || (output == NULL)) {
+		fatal_error("Out of memory.\n");
+	}
+
+	donut_group_tiles(tile_order, input, tile_count, cycle_limit, least_cycles);
+	for (i = 0; i < (size_t)tile_count; ++i) {
+		memcpy(grouped + i*16, input + tile_order[i]*16, 16);
+		tile_map[tile_order[i]*2 + 0] = i & 0xff;
+		tile_map[tile_order[i]*2 + 1] = (i >> 8) & 0xff;
+	}
+	// packed with the same cycle limit the tiles were grouped for
+	output_length = donut_pack_blocks(output, grouped, tile_count / 4, cycle_limit);
+	i = tile_count*16;
+	write_entire_file(output_file, output_filename, output, output_length);
+
+	FILE *tile_map_file = fopen(tile_map_filename, "wb");
+	if (tile_map_file == NULL) {
+		fatal_perror(tile_map_filename);
+	}
+	write_entire_file(tile_map_file, tile_map_filename, tile_map, tile_count*2);
+	fclose(tile_map_file);
+
+	*total_bytes_in += i;
+	*total_bytes_out += output_length;
+	free(output);
+	free(tile_map);
+	free(grouped);
+	free(tile_order);
+	free(input);
+	return input_length - i;
+}
+
+static int default_job_count(void)
+{
+#ifdef _SC_NPROCESSORS_ONLN
+	long n = sysconf(_SC_NPROCESSORS_ONLN);
+	if (n > 0)
+		return n;
+#endif
+	return 1;
+}
+
+struct job_queue {
+	pthread_mutex_t lock;
+	int next_job;
+	int job_count;
+	void (*job)(void *context, int job_index);
+	void *context;
+};
+
+static void *job_worker(void *arg)
+{
+	struct job_queue *queue = arg;
+	while (1) {
+		pthread_mutex_lock(&queue->lock);
+		int job_index = queue->next_job;
+		if (job_index < queue->job_count)
+			++queue->next_job;
+		pthread_mutex_unlock(&queue->lock);
+		if (job_index >= queue->job_count)
+			break;
+		queue->job(queue->context, job_index);
+	}
+	return NULL;
+}
+
+// Calls job(context, i) for each i from 0 to job_count-1 using up to
+// thread_count threads, and returns once all of them are finished.
+static void run_jobs(int job_count, int thread_count, void (*job)(void *context, int job_index), void *context)
+{
+	struct job_queue queue = {PTHREAD_MUTEX_INITIALIZER, 0, job_count, job, context};
+	pthread_t threads[64];
+	int i;
+	if (thread_count > job_count)
+		thread_count = job_count;
+	if (thread_count > 64)
+		thread_count = 64;
+	// the calling thread is one of the workers
+	for (i = 0; i < thread_count - 1; ++i) {
+		if (pthread_create(&threads[i], NULL, job_worker, &queue) != 0)
+			break;
+	}
+	job_worker(&queue);
+	while (i > 0) {
+		--i;
+		pthread_join(threads[i], NULL);
+	}
+}
+
+#define INES_BANK_SIZE 8192
+
+struct ines_banks {
+	const uint8_t *region;
+	size_t region_length;
+	uint8_t *output;
+	size_t *output_lengths;
+	size_t *bytes_read;
+};
+
+static void compress_ines_bank(void *context, int bank)
+{
+	struct ines_banks *banks = context;
+	size_t offset = (size_t)bank * INES_BANK_SIZE;
+	size_t length = banks->region_length - offset;
+	if (length > INES_BANK_SIZE)
+		length = INES_BANK_SIZE;
+	banks->output_lengths[bank] = donut_compress_large(
+		banks->output + (size_t)bank * donut_compress_bound(INES_BANK_SIZE),
+		donut_compress_bound(INES_BANK_SIZE), banks->region + offset, length,
+		&banks->bytes_read[bank]);
+}
+
+static size_t ines_rom_size(uint8_t lsb, uint8_t msb_nibble, size_t unit)
+{
+	if (msb_nibble == 0x0f) {
+		// NES 2.0 exponent-multiplier notation
+		if ((lsb >> 2) >= sizeof(size_t)*8 - 3)
+			fatal_error("iNES header ROM size is too large.\n");
+		return ((size_t)1 << (lsb >> 2)) * ((lsb & 0x03)*2 + 1);
+	}
+	return (((size_t)msb_nibble << 8) | lsb) * unit;
+}
+
+// Parses the OFFSET or LENGTH of --ines-region, leaving 'end' after it.
+static size_t parse_ines_region_number(const char *text, char **end)
+{
+	// strtoull() would take leading spaces and a minus sign
+	if ((*text < '0') || (*text > '9')) {
+		fatal_error("Invalid parameter for --ines-region. Must be OFFSET:LENGTH.\n");
+	}
+	errno = 0;
+	unsigned long long number = strtoull(text, end, 0);
+	if ((errno == ERANGE) || (number > SIZE_MAX)) {
+		fatal_error("--ines-region OFFSET or LENGTH is too large.\n");
+	}
+	return number;
+}
+
+// Reads an entire .nes file, and compresses each 8 KiB bank of the CHR-ROM,
+// or of the region given with --ines-region, on a pool of threads.
+// Returns: the number of trailing region bytes that was not processed.
+static size_t compress_ines(FILE *input_file, const char *input_filename,
+	FILE *output_file, const char *output_filename, const char *bank_table_filename,
+	const char *region_text, int job_count, uint64_t *total_bytes_in, uint64_t *total_bytes_out)
+{
+	size_t input_length, i;
+	uint8_t *input = read_entire_file(input_file, input_filename, &input_length);
+	if ((input_length < 16) || (memcmp(input, "NES\x1a", 4) != 0)) {
+		fatal_error("Input is not a iNES file.\n");
+	}
+	bool nes2 = ((input[7] & 0x0c) == 0x08);
+	size_t prg_size = ines_rom_size(input[4], (nes2) ? (input[9] & 0x0f) : 0, 16384);
+	size_t chr_size = ines_rom_size(input[5], (nes2) ? (input[9] >> 4) : 0, 8192);
+	size_t prg_start = 16 + ((input[6] & 0x04) ? 512 : 0);
+	size_t region_offset = prg_size;
+	size_t region_length = chr_size;
+
+	if (region_text != NULL) {
+		char *end;
+		region_offset = parse_ines_region_number(region_text, &end);
+		if (*end != ':') {
+			fatal_error("Invalid parameter for --ines-region. Must be OFFSET:LENGTH.\n");
+		}
+		region_length = parse_ines_region_number(end + 1, &end);
+		if (*end != '\0') {
+			fatal_error("Invalid parameter for --ines-region. Must be OFFSET:LENGTH.\n");
+		}
+	} else if (chr_size == 0) {
+		fatal_error("iNES file has no CHR-ROM.\n");
+	}
+	// checked piece by piece, as the sizes can be large enough to overflow
+	if ((prg_start > input_length) || (region_offset > input_length - prg_start) || (region_length > input_length - prg_start - region_offset)) {
+		fatal_error("iNES file is smaller then the header or --ines-region describes.\n");
+	}
+	size_t region_start = prg_start + region_offset;
+
+	int bank_count = (region_length + INES_BANK_SIZE - 1) / INES_BANK_SIZE;
+	struct ines_banks banks;
+	banks.region = input + region_start;
+	banks.region_length = region_length;
+	banks.output = malloc((size_t)bank_count * donut_compress_bound(INES_BANK_SIZE) + 1);
+	banks.output_lengths = malloc(sizeof(size_t) * (bank_count + 1));
+	banks.bytes_read = malloc(sizeof(size_t) * (bank_count + 1));
+	uint8_t *bank_table = malloc((size_t)bank_count * 8 + 1);
+	if ((banks.output == NULL) || (banks.output_lengths == NULL) || (banks.bytes_read == NULL) || (bank_table == NULL)) {
+		fatal_error("Out of memory.\n");
+	}
+
+	run_jobs(bank_count, job_count, compress_ines_bank, &banks);
+
+	size_t output_offset = 0;
+	size_t bytes_read = 0;
+	for (i = 0; i < (size_t)bank_count; ++i) {
+		uint32_t table_entry[2] = {output_offset, banks.output_lengths[i]};
+		int b;
+		for (b = 0; b < 8; ++b) {
+			bank_table[i*8 + b] = table_entry[b >> 2] >> ((b & 3) * 8);
+		}
+		write_entire_file(output_file, output_filename,
+			banks.output + i * donut_compress_bound(INES_BANK_SIZE), banks.output_lengths[i]);
+		output_offset += banks.output_lengths[i];
+		bytes_read += banks.bytes_read[i];
+	}
+
+	if (bank_table_filename != NULL) {
+		FILE *bank_table_file = fopen(bank_table_filename, "wb");
+		if (bank_table_file == NULL) {
+			fatal_perror(bank_table_filename);
+		}
+		write_entire_file(bank_table_file, bank_table_filename, bank_table, (size_t)bank_count * 8);
+		fclose(bank_table_file);
+	}
+
+	*total_bytes_in += bytes_read;
+	*total_bytes_out += output_offset;
+	free(bank_table);
+	free(banks.bytes_read);
+	free(banks.output_lengths);
+	free(banks.output);
+	free(input);
+	return region_length - bytes_read;
+}
+
+struct batch_file {
+	char *input_filename;
+	char *output_filename;
+	bool failed;
+	bool skipped;
+	bool duplicate;
+};
+
+struct batch {
+	struct batch_file *files;
+	bool decompress;
+	bool retarget;
+	bool force_overwrite;
+	int cycle_limit;
+	pthread_mutex_t lock;
+	uint64_t total_bytes_in;
+	uint64_t total_bytes_out;
+};
+
+static char *batch_output_filename(const char *output_dir, const char *input_filename, bool decompress, bool retarget)
+{
+	const char *name = input_filename;
+	const char *p;
+	for (p = input_filename; *p != '\0'; ++p) {
+		if ((*p == '/') || (*p == '\\'))
+			name = p + 1;
+	}
+	size_t name_length = strlen(name);
+	const char *suffix = ".donut";
+	if (retarget) {
+		suffix = "";
+	} else if (decompress) {
+		if ((name_length > 6) && (strcmp(name + name_length - 6, ".donut") == 0)) {
+			name_length -= 6;
+			suffix = "";
+		} else {
+			suffix = ".chr";
+		}
+	}
+	char *output_filename = malloc(strlen(output_dir) + name_length + strlen(suffix) + 2);
+	if (output_filename == NULL) {
+		fatal_error("Out of memory.\n");
+	}
+	sprintf(output_filename, "%s/%.*s%s", output_dir, (int)name_length, name, suffix);
+	return output_filename;
+}
+
+static void process_batch_file(void *context, int file_index)
+{
+	struct batch *batch = context;
+	struct batch_file *file = &batch->files[file_index];
+	FILE *input_file = NULL;
+	FILE *output_file = NULL;
+	uint8_t *input_buffer = NULL;
+	uint8_t *output_buffer = NULL;
+	uint64_t bytes_in = 0;
+	uint64_t bytes_out = 0;
+	size_t bytes_not_processed = 0;
+	const char *error_filename = NULL;
+	file->failed = true;
+
+	// reported before the jobs started
+	if (file->duplicate)
+		return;
+	if (!batch->force_overwrite) {
+		output_file = fopen(file->output_filename, "rb");
+		if (output_file != NULL) {
+			fclose(output_file);
+			if (verbosity_level >= 0)
+				fprintf(stderr, "%s already exists; not overwritten\n", file->output_filename);
+			file->failed = false;
+			file->skipped = true;
+			return;
+		}
+	}
+	input_file = fopen(file->input_filename, "rb");
+	if (input_file == NULL) {
+		report_perror(file->input_filename);
+		return;
+	}
+	output_file = fopen(file->output_filename, "wb");
+	if (output_file == NULL) {
+		report_perror(file->output_filename);
+		fclose(input_file);
+		return;
+	}
+	// thread stacks can be too small for these
+	input_buffer = malloc(BUF_IO_SIZE+BUF_GAP_SIZE);
+	output_buffer = malloc(BUF_IO_SIZE+BUF_GAP_SIZE);
+	if ((input_buffer == NULL) || (output_buffer == NULL)) {
+		fatal_error("Out of memory.\n");
+	}
+
+	error_filename = process_stream(input_file, file->input_filename,
+		output_file, file->output_filename, batch->decompress, batch->retarget, batch->cycle_limit,
+		input_buffer, output_buffer, &bytes_in, &bytes_out, &bytes_not_processed);
+	if (error_filename != NULL) {
+		report_perror(error_filename);
+	} else {
+		file->failed = false;
+		if ((verbosity_level >= 0) && (bytes_not_processed)) {
+			fprintf (stderr, "%s : %" PRIu64 " bytes was not processed!\n", file->output_filename, (uint64_t)bytes_not_processed);
+		}
+		if (verbosity_level >= 1) {
+			print_stats(file->output_filename, batch->decompress, bytes_in, bytes_out);
+		}
+	}
+
+	pthread_mutex_lock(&batch->lock);
+	batch->total_bytes_in += bytes_in;
+	batch->total_bytes_out += bytes_out;
+	pthread_mutex_unlock(&batch->lock);
+	free(output_buffer);
+	free(input_buffer);
+	fclose(output_file);
+	fclose(input_file);
+}
+
+static int compare_batch_output_filenames(const void *a, const void *b)
+{
+	const struct batch_file *file_a = *(struct batch_file * const *)a;
+	const struct batch_file *file_b = *(struct batch_file * const *)b;
+	return strcmp(file_a->output_filename, file_b->output_filename);
+}
+
+// Marks every file that shares its output with another file as a duplicate,
+// so that no two jobs write the same output.
+static void find_duplicate_outputs(struct batch_file *files, int file_count)
+{
+	struct batch_file **sorted = malloc(sizeof(struct batch_file *) * (file_count + 1));
+	int i;
+	if (sorted == NULL) {
+		fatal_error("Out of memory.\n");
+	}
+	for (i = 0; i < file_count; ++i) {
+		sorted[i] = &files[i];
+	}
+	qsort(sorted, file_count, sizeof(struct batch_file *), compare_batch_output_filenames);
+	for (i = 1; i < file_count; ++i) {
+		if (strcmp(sorted[i-1]->output_filename, sorted[i]->output_filename) == 0) {
+			if ((!sorted[i-1]->duplicate) && (verbosity_level >= 0))
+				fprintf(stderr, "%s is the output of more then one input\n", sorted[i]->output_filename);
+			sorted[i-1]->duplicate = true;
+			sorted[i]->duplicate = true;
+		}
+	}
+	free(sorted);
+}
+
+// Processes every file named by 'filenames', or by the lines of stdin
+// if 'use_manifest', on a pool of threads.
+// Returns: EXIT_SUCCESS if no file failed.
+static int run_batch(char **filenames, int filename_count, bool use_manifest, const char *output_dir,
+	bool decompress, bool retarget, bool force_overwrite, int cycle_limit, int job_count)
+{
+	struct batch batch = {NULL, decompress, retarget, force_overwrite, cycle_limit, PTHREAD_MUTEX_INITIALIZER, 0, 0};
+	int file_count = 0;
+	int file_capacity = 0;
+	int i;
+	char *line = NULL;
+	size_t line_capacity = 0;
+	while (1) {
+		char *input_filename, *output_filename;
+		if (use_manifest) {
+			if (getline(&line, &line_capacity, stdin) == -1)
+				break;
+			line[strcspn(line, "\r\n")] = '\0';
+			if (line[0] == '\0')
+				continue;
+			input_filename = line;
+			output_filename = strchr(line, '\t');
+			if (output_filename != NULL) {
+				*output_filename = '\0';
+				output_filename = strdup(output_filename + 1);
+			} else if (output_dir != NULL) {
+				output_filename = batch_output_filename(output_dir, input_filename, decompress, retarget);
+			} else {
+				fatal_error("--manifest lines need INPUT<tab>OUTPUT without --output-dir.\n");
+			}
+			input_filename = strdup(input_filename);
+		} else {
+			if (file_count >= filename_count)
+				break;
+			input_filename = strdup(filenames[file_count]);
+			output_filename = batch_output_filename(output_dir, input_filename, decompress, retarget);
+		}
+		if (file_count >= file_capacity) {
+			file_capacity = file_capacity*2 + 64;
+			batch.files = realloc(batch.files, sizeof(struct batch_file) * file_capacity);
+		}
+		if ((batch.files == NULL) || (input_filename == NULL) || (output_filename == NULL)) {
+			fatal_error("Out of memory.\n");
+		}
+		batch.files[file_count].input_filename = input_filename;
+		batch.files[file_count].output_filename = output_filename;
+		batch.files[file_count].failed = false;
+		batch.files[file_count].skipped = false;
+		batch.files[file_count].duplicate = false;
+		++file_count;
+	}
+	free(line);
+
+	find_duplicate_outputs(batch.files, file_count);
+	run_jobs(file_count, job_count, process_batch_file, &batch);
+
+	int failed_count = 0;
+	int skipped_count = 0;
+	for (i = 0; i < file_count; ++i) {
+		if (batch.files[i].failed)
+			++failed_count;
+		if (batch.files[i].skipped)
+			++skipped_count;
+		free(batch.files[i].input_filename);
+		free(batch.files[i].output_filename);
+	}
+	free(batch.files);
+
+	if (verbosity_level >= 1) {
+		print_stats("<total>", decompress, batch.total_bytes_in, batch.total_bytes_out);
+		if (skipped_count)
+			fprintf (stderr, "%d of %d files skipped\n", skipped_count, file_count);
+	}
+	if ((verbosity_level >= 0) && (failed_count)) {
+		fprintf (stderr, "%d of %d files failed\n", failed_count, file_count);
+	}
+	return (failed_count) ? EXIT_FAILURE : EXIT_SUCCESS;
+}
+
 int main (int argc, char **argv)
 {
 	int c;
@@ -68,22 +683,28 @@ int main (int argc, char **argv)
 	FILE *input_file = NULL;
 	FILE *output_file = NULL;
 	bool decompress = false;
+	bool retarget = false;
 	bool force_overwrite = false;
 	bool use_stdio_for_data = false;
+	bool group_tiles = false;
+	bool group_tiles_by_cycles = false;
+	char *tile_map_filename = NULL;
+	bool ines = false;
+	char *ines_region = NULL;
+	char *bank_table_filename = NULL;
+	int job_count = default_job_count();
+	char *output_dir = NULL;
+	bool use_manifest = false;
 //	bool no_bit_flip_blocks = false;
 //	bool interleaved_dont_care_bits = false;
 	uint8_t input_buffer[BUF_IO_SIZE+BUF_GAP_SIZE];
-	int input_buffer_length = 0;
+	size_t input_buffer_length = 0;
 	uint8_t output_buffer[BUF_IO_SIZE+BUF_GAP_SIZE];
-	int output_buffer_length = 0;
-
-	int total_bytes_in = 0;
-	int total_bytes_out = 0;
-	float total_bytes_ratio = 0.0;
 
-	int i, l;
+	uint64_t total_bytes_in = 0;
+	uint64_t total_bytes_out = 0;
 
-//	int cycle_limit = 10000;
+	int cycle_limit = 0;
 
 	setvbuf(stdin, NULL, _IONBF, 0);
 	setvbuf(stdout, NULL, _IONBF, 0);
@@ -99,15 +720,24 @@ int main (int argc, char **argv)
 			{"force",       no_argument,       NULL, 'f'},
 			{"verbose",     no_argument,       NULL, 'v'}, /* to be used */
 			{"quiet",       no_argument,       NULL, 'q'},
+			{"group-tiles", optional_argument, NULL, 'g'+256},
+			{"tile-map",    required_argument, NULL, 'm'+256},
+			{"ines",        no_argument,       NULL, 'i'+256},
+			{"ines-region", required_argument, NULL, 'R'+256},
+			{"bank-table",  required_argument, NULL, 't'+256},
+			{"jobs",        required_argument, NULL, 'j'},
+			{"output-dir",  required_argument, NULL, 'O'+256},
+			{"manifest",    no_argument,       NULL, 'M'+256},
 //			{"no-bit-flip", no_argument,       NULL, 'b'+256},
-//			{"cycle-limit", required_argument, NULL, 'y'+256},
+			{"retarget",    no_argument,       NULL, 'r'+256},
+			{"cycle-limit", required_argument, NULL, 'y'+256},
 //			{"interleaved-dont-care-bits", no_argument, NULL, 'd'+256},
 			{NULL, 0, NULL, 0}
 		};
 		/* getopt_long stores the option index here. */
 		int option_index = 0;
 
-		c = getopt_long(argc, argv, "hVzdo:cfvq",
+		c = getopt_long(argc, argv, "hVzdo:cfvqj:",
 						long_options, &option_index);
 
 		/* Detect the end of the options. */
@@ -121,9 +751,15 @@ int main (int argc, char **argv)
 
 		break; case 'z':
 			decompress = false;
+			retarget = false;
 
 		break; case 'd':
 			decompress = true;
+			retarget = false;
+
+		break; case 'r'+256:
+			decompress = false;
+			retarget = true;
 
 		break; case 'o':
 			output_filename = optarg;
@@ -142,11 +778,45 @@ int main (int argc, char **argv)
 			verbosity_level = -1;
 			opterr = 0;
 
+		break; case 'g'+256:
+			group_tiles = true;
+			if ((optarg == NULL) || (strcmp(optarg, "size") == 0)) {
+				group_tiles_by_cycles = false;
+			} else if (strcmp(optarg, "cycles") == 0) {
+				group_tiles_by_cycles = true;
+			} else {
+				fatal_error("Invalid parameter for --group-tiles. Must be 'size' or 'cycles'.\n");
+			}
+
+		break; case 'm'+256:
+			tile_map_filename = optarg;
+
+		break; case 'i'+256:
+			ines = true;
+
+		break; case 'R'+256:
+			ines_region = optarg;
+
+		break; case 't'+256:
+			bank_table_filename = optarg;
+
+		break; case 'O'+256:
+			output_dir = optarg;
+
+		break; case 'M'+256:
+			use_manifest = true;
+
+		break; case 'j':
+			job_count = strtol(optarg, NULL, 0);
+			if (job_count < 1) {
+				fatal_error("Invalid parameter for --jobs. Must be a integer >= 1.\n");
+			}
+
 //		break; case 'b'+256:
 //			no_bit_flip_blocks = true;
 
-//		break; case 'y'+256:
-//			cycle_limit = strtol(optarg, NULL, 0);
+		break; case 'y'+256:
+			cycle_limit = strtol(optarg, NULL, 0);
 
 //		break; case 'd'+256:
 //			interleaved_dont_care_bits = true;
@@ -164,9 +834,44 @@ int main (int argc, char **argv)
 		fclose(stderr);
 	}
 
-//	if (cycle_limit < 1268) {
-//		fatal_error("Invalid parameter for --cycle-limit. Must be a integer >= 1268.\n");
-//	}
+	if (cycle_limit && (cycle_limit < 1268)) {
+		fatal_error("Invalid parameter for --cycle-limit. Must be a integer >= 1268.\n");
+	}
+
+	if (retarget && (!cycle_limit)) {
+		fatal_error("--retarget requires --cycle-limit.\n");
+	}
+
+	if (cycle_limit && (!retarget) && (!group_tiles)) {
+		fatal_error("--cycle-limit can only be used with --retarget or --group-tiles.\n");
+	}
+
+	if (group_tiles && (decompress || retarget)) {
+		fatal_error("--group-tiles can only be used when compressing.\n");
+	}
+
+	if (ines && (decompress || retarget || group_tiles)) {
+		fatal_error("--ines can only be used when compressing.\n");
+	}
+
+	if ((!ines) && ((ines_region != NULL) || (bank_table_filename != NULL))) {
+		fatal_error("--ines-region and --bank-table require --ines.\n");
+	}
+
+	if (group_tiles && (tile_map_filename == NULL)) {
+		fatal_error("--group-tiles requires --tile-map=FILE.\n");
+	}
+
+	if ((output_dir != NULL) || use_manifest) {
+		if (group_tiles || ines || use_stdio_for_data || (output_filename != NULL)) {
+			fatal_error("--output-dir and --manifest can't be used with -o, -c, --group-tiles or --ines.\n");
+		}
+		if (use_manifest && (optind < argc)) {
+			fatal_error("INPUT files can't be used with --manifest.\n");
+		}
+		exit(run_batch(argv + optind, argc - optind, use_manifest, output_dir,
+			decompress, retarget, force_overwrite, cycle_limit, job_count));
+	}
 
 	if ((input_filename == NULL) && (optind < argc)) {
 		input_filename = argv[optind];
@@ -257,51 +962,24 @@ int main (int argc, char **argv)
 	}
 
 	bool done = false;
-	while(1) {
-		if (!feof(input_file) && (input_buffer_length < BUF_GAP_SIZE)) {
-			l = fread(input_buffer + input_buffer_length, sizeof(uint8_t), BUF_IO_SIZE, input_file);
-			if (ferror(input_file)) {
-				fatal_perror(input_filename);
-			}
-			input_buffer_length += l;
-		}
-
-		if (decompress) {
-			l = donut_decompress(output_buffer + output_buffer_length, BUF_IO_SIZE+BUF_GAP_SIZE - output_buffer_length, input_buffer, input_buffer_length, &i);
-		} else {
-			l = donut_compress(output_buffer + output_buffer_length, BUF_IO_SIZE+BUF_GAP_SIZE - output_buffer_length, input_buffer, input_buffer_length, &i);
-		}
-		total_bytes_in += i;
-		total_bytes_out += l;
-		output_buffer_length += l;
-		if ((l == 0) && (i == 0))
-			done = true;
-
-		if (input_buffer_length - i > 0) {
-			memmove(input_buffer, input_buffer + i, input_buffer_length - i);
-		}
-		input_buffer_length -= i;
-
-		if (output_buffer_length >= BUF_IO_SIZE) {
-			l = fwrite(output_buffer, sizeof(uint8_t), BUF_IO_SIZE, output_file);
-			if (ferror(output_file)) {
-				fatal_perror(output_filename);
-			}
-			if (output_buffer_length - l > 0) {
-				memmove(output_buffer, output_buffer + l, output_buffer_length - l);
-			}
-			output_buffer_length -= l;
-		}
-
-		if (done) {
-			if (output_buffer_length) {
-				l = fwrite(output_buffer, sizeof(uint8_t), output_buffer_length, output_file);
-				if (ferror(output_file)) {
-					fatal_error(output_filename);
-				}
-			}
-			output_buffer_length -= l;
-			break;
+	if (group_tiles) {
+		input_buffer_length = group_tiles_and_compress(input_file, input_filename,
+			output_file, output_filename, tile_map_filename,
+			cycle_limit, group_tiles_by_cycles, &total_bytes_in, &total_bytes_out);
+		done = true;
+	}
+	if (ines) {
+		input_buffer_length = compress_ines(input_file, input_filename,
+			output_file, output_filename, bank_table_filename,
+			ines_region, job_count, &total_bytes_in, &total_bytes_out);
+		done = true;
+	}
+	if (!done) {
+		const char *error_filename = process_stream(input_file, input_filename,
+			output_file, output_filename, decompress, retarget, cycle_limit,
+			input_buffer, output_buffer, &total_bytes_in, &total_bytes_out, &input_buffer_length);
+		if (error_filename != NULL) {
+			fatal_perror(error_filename);
 		}
 	}
 
@@ -314,20 +992,11 @@ int main (int argc, char **argv)
 	}
 
 	if ((verbosity_level >= 0) && (input_buffer_length)) {
-		fprintf (stderr, "%s : %d bytes was not processed!\n", output_filename, input_buffer_length);
+		fprintf (stderr, "%s : %" PRIu64 " bytes was not processed!\n", output_filename, (uint64_t)input_buffer_length);
 	}
 
 	if (verbosity_level >= 1) {
-		if (decompress) {
-			if (total_bytes_out != 0) {
-				total_bytes_ratio = (1.0 - ((float)total_bytes_in / (float)total_bytes_out))*100.0;
-			}
-		} else {
-			if (total_bytes_in != 0) {
-				total_bytes_ratio = (1.0 - ((float)total_bytes_out / (float)total_bytes_in))*100.0;
-			}
-		}
-		fprintf (stderr, "%s :%#5.1f%% (%d => %d bytes)\n", output_filename, total_bytes_ratio, total_bytes_in, total_bytes_out);
+		print_stats(output_filename, decompress, total_bytes_in, total_bytes_out);
 	}
 
 	exit(EXIT_SUCCESS);
@@ -53,20 +53,99 @@ int donut_decompress(uint8_t* dst, int dst_capacity, const uint8_t* src, int src
 // Like donut_decompress(), in reverse.
 int donut_compress(uint8_t* dst, int dst_capacity, const uint8_t* src, int src_length, int* src_bytes_read);
 
+// Like donut_decompress() and donut_compress(), but with size_t lengths
+// for buffers of 2 GiB or more.
+size_t donut_decompress_large(uint8_t* dst, size_t dst_capacity, const uint8_t* src, size_t src_length, size_t* src_bytes_read);
+size_t donut_compress_large(uint8_t* dst, size_t dst_capacity, const uint8_t* src, size_t src_length, size_t* src_bytes_read);
+
+// Compress 'count' independent buffers, 'srcs[i]' of 'src_lengths[i]' bytes,
+// back to back into 'dst' without allocating memory. 'dst_offsets[i]' and
+// 'dst_lengths[i]' are written with where each compressed buffer is in 'dst'.
+// Like donut_compress(), trailing bytes that don't fill a block are skipped.
+// Returns: the number of buffers compressed before 'dst' ran out of room.
+size_t donut_compress_batch(uint8_t* dst, size_t dst_capacity, const uint8_t* const* srcs, const size_t* src_lengths, size_t count, size_t* dst_offsets, size_t* dst_lengths);
+
+// Copy the blocks of a compressed stream, re-packing only the blocks that
+// take more then 'cpu_limit' cycles to decode. The rest are passed through
+// unchanged. Arguments and return value are like donut_decompress_large().
+size_t donut_retarget(uint8_t* dst, size_t dst_capacity, const uint8_t* src, size_t src_length, size_t* src_bytes_read, int cpu_limit);
+
 // When compressing, the source can expand to a maximum ratio of 65:64.
 // use this to figure how large you should make the 'dst' buffer.
 #define donut_compress_bound(x) ((((x) + 63) / 64) * 65)
 
+// A view of the blocks in a compressed buffer that decodes each block on
+// first access, and keeps up to 'cache_size' decoded blocks, dropping the
+// least recently used one. The offsets of blocks found along the way are
+// kept, so seeking back to a block doesn't rescan the buffer.
+struct donut_view {
+	const uint8_t* src;
+	size_t src_length;
+	size_t* block_offsets; // start of each block found, then the end of the last
+	int* block_slots;      // cache slot of each block found, or -1
+	size_t block_count;
+	size_t block_capacity;
+	uint8_t* cache;        // 64 bytes for each slot
+	size_t* slot_blocks;
+	int* slot_prev;
+	int* slot_next;
+	int cache_size;
+	int cache_used;
+	int most_recent;
+	int least_recent;
+};
+
+// The view doesn't copy 'src', so it must outlive the view.
+// Returns: false if memory couldn't be allocated.
+bool donut_view_init(struct donut_view* view, const uint8_t* src, size_t src_length, int cache_size);
+void donut_view_free(struct donut_view* view);
+
+// Returns: a pointer to the 64 decoded bytes of the block, or to the 16
+// bytes of the tile, that's valid until the next access to the view.
+// NULL if the block is past the end of the buffer or can't be decoded.
+const uint8_t* donut_view_block(struct donut_view* view, size_t block_index);
+const uint8_t* donut_view_tile(struct donut_view* view, size_t tile_index);
+
+// Search for an order of the 16 byte tiles in 'src' (of 'tile_count' tiles)
+// where each group of 4 tiles packs into a small block, or a fast block if
+// 'least_cycles' is true. Each step only looks DONUT_GROUP_WINDOW tiles
+// ahead, though a tile can be carried further by a chain of steps.
+// 'tile_order' is written with the original index of each tile in the
+// new order. Trailing tiles that don't fill a block are left in place.
+void donut_group_tiles(int* tile_order, const uint8_t* src, int tile_count, int cpu_limit, bool least_cycles);
+#ifndef DONUT_GROUP_WINDOW
+#define DONUT_GROUP_WINDOW 64
+#endif
+#ifndef DONUT_GROUP_PASSES
+#define DONUT_GROUP_PASSES 4
+#endif
+
 int donut_unpack_block(uint8_t* dst, const uint8_t* src);
+
+// Decode only the 16 byte tile 'tile_index' (0 to 3) of the block at 'src'
+// into 'dst', skipping over the pb8 planes of the other 3 tiles.
+// Returns: the length of the whole block like donut_unpack_block(),
+// or 0 if the block can't be decoded.
+int donut_unpack_tile(uint8_t* dst, const uint8_t* src, int tile_index);
 int donut_pack_block(uint8_t* dst, const uint8_t* src, int cpu_limit, const uint8_t* mask);
+
+// Like donut_pack_block() with no mask, but for 'block_count' consecutive
+// blocks. 'dst' needs donut_compress_bound(block_count*64) bytes.
+// Returns: the number of bytes written to 'dst'.
+int donut_pack_blocks(uint8_t* dst, const uint8_t* src, int block_count, int cpu_limit);
 int donut_unpack_pb8(uint64_t* dst, const uint8_t* src, uint8_t top_value);
 int donut_pack_pb8(uint8_t* dst, uint64_t src, uint8_t top_value);
 uint64_t donut_flip_plane(uint64_t plane);
 int donut_block_runtime_cost(const uint8_t* buf, int len);
 
+// Find the length of the compressed block at 'src' without decoding it,
+// reading at most 74 bytes. Returns 0 if the block can't be decoded.
+int donut_block_length(const uint8_t* src);
+
 #ifdef DONUT_NES_IMPLEMENTATION
 
 #include <string.h>
+#include <stdlib.h>
 
 static uint64_t donut_read_uint64_le(const uint8_t* buf)
 {
@@ -214,6 +293,93 @@ static uint8_t donut_popcount(uint8_t x)
 	return (int)x;
 }
 
+int donut_unpack_tile(uint8_t* dst, const uint8_t* src, int tile_index)
+{
+	int i;
+	const uint8_t* p = src;
+	uint8_t block_header = *p;
+	++p;
+	if ((block_header & 0x3e) == 0x00) {
+		memset(dst, 0x00, 16);
+		return 1;
+	}
+	if (block_header >= 0xc0)
+		return 0;
+	if (block_header == 0x2a) {
+		memcpy(dst, p + (tile_index & 3)*16, 16);
+		return 65;
+	}
+	uint8_t plane_def = 0xffaa5500 >> ((block_header & 0x0c) << 1);
+	bool single_plane_mode = false;
+	if (block_header & 0x02) {
+		plane_def = *p;
+		++p;
+		single_plane_mode = ((block_header & 0x04) && (plane_def != 0x00));
+	}
+	uint64_t prev_plane = 0x0000000000000000;
+	for (i = 0; i < 8; ++i) {
+		if ((i >> 1) != (tile_index & 3)) {
+			// only the pb8 flags are needed to skip over a plane
+			if (plane_def & 0x80) {
+				if (single_plane_mode)
+					p = src+2;
+				p += 1 + donut_popcount(*p);
+			}
+			plane_def <<= 1;
+			continue;
+		}
+		uint64_t plane = 0x0000000000000000;
+		if ((!(i & 1) && (block_header & 0x20)) || ((i & 1) && (block_header & 0x10))) {
+			plane = 0xffffffffffffffff;
+		}
+		if (plane_def & 0x80) {
+			if (single_plane_mode)
+				p = src+2;
+			p += donut_unpack_pb8(&plane, p, (uint8_t)plane);
+			if (block_header & 0x01)
+				plane = donut_flip_plane(plane);
+		}
+		plane_def <<= 1;
+		if (i & 1) {
+			if (block_header & 0x80)
+				prev_plane ^= plane;
+			if (block_header & 0x40)
+				plane ^= prev_plane;
+			donut_write_uint64_le(dst, prev_plane);
+			donut_write_uint64_le(dst + 8, plane);
+		}
+		prev_plane = plane;
+	}
+	return p - src;
+}
+
+int donut_block_length(const uint8_t* src)
+{
+	int i;
+	const uint8_t* p = src;
+	uint8_t block_header = *p;
+	++p;
+	if ((block_header & 0x3e) == 0x00)
+		return 1;
+	if (block_header >= 0xc0)
+		return 0;
+	if (block_header == 0x2a)
+		return 65;
+	uint8_t plane_def = 0xffaa5500 >> ((block_header & 0x0c) << 1);
+	if (block_header & 0x02) {
+		plane_def = *p;
+		++p;
+		if ((block_header & 0x04) && (plane_def != 0x00))
+			return 3 + donut_popcount(*p);
+	}
+	for (i = 0; i < 8; ++i) {
+		if (plane_def & 0x80)
+			p += 1 + donut_popcount(*p);
+		plane_def <<= 1;
+	}
+	return p - src;
+}
+
 int donut_block_runtime_cost(const uint8_t* buf, int len)
 {
 	if (len <= 0)
@@ -328,14 +494,171 @@ static bool donut_nes_all_pb8_planes_match(const uint8_t* buf, int len, int pb8_
 	return true;
 }
 
-int donut_pack_block(uint8_t* dst, const uint8_t* src, int cpu_limit, const uint8_t* mask)
+// Encode the 8 planes with the block mode 'a' and keep the result in 'dst'
+// if it is shorter (or equally short but faster) then the current best.
+static void donut_pack_block_mode(uint8_t* dst, const uint64_t* planes, uint8_t a, int cpu_limit, int* shortest_len, int* least_cost)
 {
-	uint64_t planes[(mask) ? 16 : 8];
 	uint8_t cblock[76];
 	// 2+9*8 == 74 for max encoded block
 	// 65+11 == 76 for uncompressed block with a optimized block test
 	int i;
 
+	// With the block mode in mind, pack the 64 bytes of data into 8 pb8 planes.
+	uint8_t plane_def = 0x00;
+	int len = 2;
+	int pb8_count = 0;
+	uint64_t first_non_zero_plane = 0;
+	bool planes_match = true;
+	for (i = 0; i < 8; ++i) {
+		uint64_t plane_predict = 0x0000000000000000;
+		uint64_t plane = planes[i];
+		if (i & 1) {
+			if (a & 0x10)
+				plane_predict = 0xffffffffffffffff;
+			if (a & 0x40)
+				plane ^= planes[i-1];
+		} else {
+			if (a & 0x20)
+				plane_predict = 0xffffffffffffffff;
+			if (a & 0x80)
+				plane ^= planes[i+1];
+		}
+		plane_def <<= 1;
+		if (plane != plane_predict) {
+			len += donut_pack_pb8(cblock + len, plane, (uint8_t)plane_predict);
+			plane_def |= 1;
+			++pb8_count;
+			if (pb8_count == 1)
+				first_non_zero_plane = plane;
+			else if (plane != first_non_zero_plane)
+				planes_match = false;
+		}
+	}
+	cblock[0] = a | 0x02;
+	cblock[1] = plane_def;
+	// now that we have the basic block form, try to find optimizations
+	// temp_p is needed because a optimization removes a byte from the start
+	int cycles = donut_block_runtime_cost(cblock, len);
+	uint8_t* temp_p = cblock;
+	if (donut_nes_all_pb8_planes_match(temp_p, len, pb8_count) && ((cycles + pb8_count) <= cpu_limit)) {
+		temp_p[0] = a | 0x06;
+		len = ((len - 2) / pb8_count) + 2;
+		cycles += pb8_count;
+		planes_match = false; // disable that optimization
+	} else {
+		for (i = 0; i < 4*8; i += 8) {
+			if (plane_def == ((0xffaa5500 >> i) & 0xff)) {
+				++temp_p;
+				temp_p[0] = a | (i >> 1);
+				--len;
+				cycles -= 5;
+				planes_match = false; // disable that optimization
+				break;
+			}
+		}
+	}
+
+	// compare size and cpu cost to choose the block of this mode
+	// or to keep the old one.
+	if ((len <= *shortest_len) && ((cycles < *least_cost) || (len < *shortest_len)) && (cycles <= cpu_limit)) {
+		memcpy(dst, temp_p, len);
+		*shortest_len = len;
+		*least_cost = cycles;
+	}
+
+	// if possible also try this optimization where a single plane mode
+	// block has a pb8 plane with a leading 0x00/0xff byte
+	if ((pb8_count > 1) && planes_match) {
+		temp_p = cblock;
+		temp_p[0] = a | 0x06;
+		temp_p[1] = plane_def;
+		len = 2 + donut_pack_pb8(temp_p+2, first_non_zero_plane, ~(first_non_zero_plane >> (7*8)));
+		cycles = donut_block_runtime_cost(temp_p, len);
+		if ((len <= *shortest_len) && ((cycles < *least_cost) || (len < *shortest_len)) && (cycles <= cpu_limit)) {
+			memcpy(dst, temp_p, len);
+			*shortest_len = len;
+			*least_cost = cycles;
+		}
+	}
+}
+
+// Number of bytes in a pb8 plane that differ from the byte before it,
+// the byte before the first one being 'top'.
+static int donut_pb8_literal_count(uint64_t plane, uint8_t top)
+{
+	uint64_t t = plane ^ ((plane >> 8) | ((uint64_t)top << 56));
+	t |= t >> 4;
+	t |= t >> 2;
+	t |= t >> 1;
+	t &= 0x0101010101010101;
+	return (t * 0x0101010101010101) >> 56;
+}
+
+// Find the lengths of the pb8 planes for the block mode 'a' without encoding
+// them, to tell if any form of this mode could be as short as 'shortest_len'
+// and within 'cpu_limit'. If not, donut_pack_block_mode() can be skipped.
+static bool donut_pack_block_mode_may_improve(const uint64_t* planes, uint8_t a, int cpu_limit, int shortest_len)
+{
+	uint8_t plane_def = 0x00;
+	int len = 2;
+	int pb8_count = 0;
+	uint64_t first_non_zero_plane = 0;
+	bool planes_match = true;
+	int i, l;
+	for (i = 0; i < 8; ++i) {
+		uint64_t plane_predict = 0x0000000000000000;
+		uint64_t plane = planes[i];
+		if (i & 1) {
+			if (a & 0x10)
+				plane_predict = 0xffffffffffffffff;
+			if (a & 0x40)
+				plane ^= planes[i-1];
+		} else {
+			if (a & 0x20)
+				plane_predict = 0xffffffffffffffff;
+			if (a & 0x80)
+				plane ^= planes[i+1];
+		}
+		plane_def <<= 1;
+		if (plane != plane_predict) {
+			len += 1 + donut_pb8_literal_count(plane, (uint8_t)plane_predict);
+			plane_def |= 1;
+			++pb8_count;
+			if (pb8_count == 1)
+				first_non_zero_plane = plane;
+			else if (plane != first_non_zero_plane)
+				planes_match = false;
+		}
+	}
+
+	// every form of this mode costs at least this many cycles
+	int cycles = 1298 + ((a & 0xc0) ? 640 : 0) + ((a & 0x20) ? 4 : 0) + ((a & 0x10) ? 4 : 0);
+	cycles += pb8_count * ((a & 0x01) ? 614 : 75);
+	if (cycles > cpu_limit)
+		return false;
+
+	// the shortest of the forms donut_pack_block_mode() tries
+	int bound = len;
+	for (i = 0; i < 4*8; i += 8) {
+		if (plane_def == ((0xffaa5500 >> i) & 0xff))
+			bound = len - 1;
+	}
+	if ((pb8_count > 1) && !((len - 2) % pb8_count)) {
+		l = 2 + (len - 2) / pb8_count;
+		bound = (l < bound) ? l : bound;
+	}
+	if ((pb8_count > 1) && planes_match) {
+		l = 4 + donut_pb8_literal_count(first_non_zero_plane, first_non_zero_plane >> 56);
+		bound = (l < bound) ? l : bound;
+	}
+	return bound <= shortest_len;
+}
+
+int donut_pack_block(uint8_t* dst, const uint8_t* src, int cpu_limit, const uint8_t* mask)
+{
+	uint64_t planes[(mask) ? 16 : 8];
+	int i;
+
 	// if no limit specified, then basically unlimited.
 	cpu_limit = (cpu_limit) ? cpu_limit : 16384;
 
@@ -371,83 +694,8 @@ int donut_pack_block(uint8_t* dst, const uint8_t* src, int cpu_limit, const uint
 		}
 		if (mask)
 			donut_nes_fill_dont_care_bits(planes, planes+8, a);
-		// With the block mode in mind, pack the 64 bytes of data into 8 pb8 planes.
-		uint8_t plane_def = 0x00;
-		int len = 2;
-		int pb8_count = 0;
-		uint64_t first_non_zero_plane = 0;
-		bool planes_match = true;
-		for (i = 0; i < 8; ++i) {
-			uint64_t plane_predict = 0x0000000000000000;
-			uint64_t plane = planes[i];
-			if (i & 1) {
-				if (a & 0x10)
-					plane_predict = 0xffffffffffffffff;
-				if (a & 0x40)
-					plane ^= planes[i-1];
-			} else {
-				if (a & 0x20)
-					plane_predict = 0xffffffffffffffff;
-				if (a & 0x80)
-					plane ^= planes[i+1];
-			}
-			plane_def <<= 1;
-			if (plane != plane_predict) {
-				len += donut_pack_pb8(cblock + len, plane, (uint8_t)plane_predict);
-				plane_def |= 1;
-				++pb8_count;
-				if (pb8_count == 1)
-					first_non_zero_plane = plane;
-				else if (plane != first_non_zero_plane)
-					planes_match = false;
-			}
-		}
-		cblock[0] = a | 0x02;
-		cblock[1] = plane_def;
-		// now that we have the basic block form, try to find optimizations
-		// temp_p is needed because a optimization removes a byte from the start
-		int cycles = donut_block_runtime_cost(cblock, len);
-		uint8_t* temp_p = cblock;
-		if (donut_nes_all_pb8_planes_match(temp_p, len, pb8_count) && ((cycles + pb8_count) <= cpu_limit)) {
-			temp_p[0] = a | 0x06;
-			len = ((len - 2) / pb8_count) + 2;
-			cycles += pb8_count;
-			planes_match = false; // disable that optimization
-		} else {
-			for (i = 0; i < 4*8; i += 8) {
-				if (plane_def == ((0xffaa5500 >> i) & 0xff)) {
-					++temp_p;
-					temp_p[0] = a | (i >> 1);
-					--len;
-					cycles -= 5;
-					planes_match = false; // disable that optimization
-					break;
-				}
-			}
-		}
-
-		// compare size and cpu cost to choose the block of this mode
-		// or to keep the old one.
-		if ((len <= shortest_len) && ((cycles < least_cost) || (len < shortest_len)) && (cycles <= cpu_limit)) {
-			memcpy(dst, temp_p, len);
-			shortest_len = len;
-			least_cost = cycles;
-		}
-
-		// if possible also try this optimization where a single plane mode
-		// block has a pb8 plane with a leading 0x00/0xff byte
-		if ((pb8_count > 1) && planes_match) {
-			temp_p = cblock;
-			temp_p[0] = a | 0x06;
-			temp_p[1] = plane_def;
-			len = 2 + donut_pack_pb8(temp_p+2, first_non_zero_plane, ~(first_non_zero_plane >> (7*8)));
-			cycles = donut_block_runtime_cost(temp_p, len);
-			if ((len <= shortest_len) && ((cycles < least_cost) || (len < shortest_len)) && (cycles <= cpu_limit)) {
-				memcpy(dst, temp_p, len);
-				shortest_len = len;
-				least_cost = cycles;
-			}
-		}
+		if (donut_pack_block_mode_may_improve(planes, a, cpu_limit, shortest_len))
+			donut_pack_block_mode(dst, planes, a, cpu_limit, &shortest_len, &least_cost);
 
 		// onto the next block mode.
 		a += 0x10;
@@ -456,16 +704,51 @@ int donut_pack_block(uint8_t* dst, const uint8_t* src, int cpu_limit, const uint
 	return shortest_len;
 }
 
-int donut_decompress(uint8_t* dst, int dst_capacity, const uint8_t* src, int src_length, int* src_bytes_read)
+int donut_pack_blocks(uint8_t* dst, const uint8_t* src, int block_count, int cpu_limit)
 {
-	uint8_t scratch_space[64+74];
 	int dst_length = 0;
-	int bytes_read = 0;
+	int i;
+	for (i = 0; i < block_count; ++i) {
+		dst_length += donut_pack_block(dst + dst_length, src + i*64, cpu_limit, NULL);
+	}
+	return dst_length;
+}
+
+size_t donut_compress_batch(uint8_t* dst, size_t dst_capacity, const uint8_t* const* srcs, const size_t* src_lengths, size_t count, size_t* dst_offsets, size_t* dst_lengths)
+{
+	uint8_t scratch_space[65];
+	size_t dst_length = 0;
+	size_t item, block;
+	int l;
+	for (item = 0; item < count; ++item) {
+		dst_offsets[item] = dst_length;
+		for (block = 0; block < src_lengths[item] / 64; ++block) {
+			const uint8_t* src = srcs[item] + block*64;
+			if (dst_capacity - dst_length >= 65) {
+				dst_length += donut_pack_block(dst + dst_length, src, 0, NULL);
+				continue;
+			}
+			l = donut_pack_block(scratch_space, src, 0, NULL);
+			if ((size_t)l > dst_capacity - dst_length)
+				return item;
+			memcpy(dst + dst_length, scratch_space, l);
+			dst_length += l;
+		}
+		dst_lengths[item] = dst_length - dst_offsets[item];
+	}
+	return count;
+}
+
+size_t donut_decompress_large(uint8_t* dst, size_t dst_capacity, const uint8_t* src, size_t src_length, size_t* src_bytes_read)
+{
+	uint8_t scratch_space[64+74];
+	size_t dst_length = 0;
+	size_t bytes_read = 0;
 	int l;
 	while (1) {
-		int src_bytes_remain = src_length - bytes_read;
-		int dst_bytes_remain = dst_capacity - dst_length;
-		if (src_bytes_remain <= 0)
+		size_t src_bytes_remain = src_length - bytes_read;
+		size_t dst_bytes_remain = dst_capacity - dst_length;
+		if (src_bytes_remain == 0)
 			break;
 		if (dst_bytes_remain < 64)
 			break;
@@ -473,7 +756,7 @@ int donut_decompress(uint8_t* dst, int dst_capacity, const uint8_t* src, int src
 			memset(scratch_space, 0x00, 64+74);
 			memcpy(scratch_space+64, src + bytes_read, src_bytes_remain);
 			l = donut_unpack_block(scratch_space, scratch_space+64);
-			if ((!l) || (l > src_bytes_remain))
+			if ((!l) || ((size_t)l > src_bytes_remain))
 				break;
 			memcpy(dst + dst_length, scratch_space, 64);
 			bytes_read += l;
@@ -493,24 +776,24 @@ int donut_decompress(uint8_t* dst, int dst_capacity, const uint8_t* src, int src
 	return dst_length;
 }
 
-int donut_compress(uint8_t* dst, int dst_capacity, const uint8_t* src, int src_length, int* src_bytes_read)
+size_t donut_compress_large(uint8_t* dst, size_t dst_capacity, const uint8_t* src, size_t src_length, size_t* src_bytes_read)
 {
 	uint8_t scratch_space[64+65];
-	int dst_length = 0;
-	int bytes_read = 0;
+	size_t dst_length = 0;
+	size_t bytes_read = 0;
 	int l;
 	while (1) {
-		int src_bytes_remain = src_length - bytes_read;
-		int dst_bytes_remain = dst_capacity - dst_length;
+		size_t src_bytes_remain = src_length - bytes_read;
+		size_t dst_bytes_remain = dst_capacity - dst_length;
 		if (src_bytes_remain < 64)
 			break;
-		if (dst_bytes_remain <= 0)
+		if (dst_bytes_remain == 0)
 			break;
 		if (dst_bytes_remain < 65) {
 			memset(scratch_space, 0x00, 64+65);
 			memcpy(scratch_space, src + bytes_read, 64);
 			l = donut_pack_block(scratch_space+64, scratch_space, 0, NULL);
-			if ((!l) || (l > dst_bytes_remain))
+			if ((!l) || ((size_t)l > dst_bytes_remain))
 				break;
 			memcpy(dst + dst_length, scratch_space+64, l);
 			bytes_read += 64;
@@ -529,5 +812,304 @@ int donut_compress(uint8_t* dst, int dst_capacity, const uint8_t* src, int src_l
 	return dst_length;
 }
 
+size_t donut_retarget(uint8_t* dst, size_t dst_capacity, const uint8_t* src, size_t src_length, size_t* src_bytes_read, int cpu_limit)
+{
+	uint8_t scratch_space[64+74];
+	size_t dst_length = 0;
+	size_t bytes_read = 0;
+	// blocks already under cpu_limit are copied in runs
+	size_t run_start = 0;
+	size_t run_length = 0;
+	int l;
+	while (1) {
+		size_t src_bytes_remain = src_length - bytes_read;
+		size_t dst_bytes_remain = dst_capacity - dst_length - run_length;
+		const uint8_t* block = src + bytes_read;
+		if (src_bytes_remain == 0)
+			break;
+		if (src_bytes_remain < 74) {
+			memset(scratch_space, 0x00, 64+74);
+			memcpy(scratch_space+64, block, src_bytes_remain);
+			block = scratch_space+64;
+		}
+		l = donut_block_length(block);
+		if ((!l) || ((size_t)l > src_bytes_remain))
+			break;
+		if ((!cpu_limit) || (donut_block_runtime_cost(block, l) <= cpu_limit)) {
+			if ((size_t)l > dst_bytes_remain)
+				break;
+			if (!run_length)
+				run_start = bytes_read;
+			run_length += l;
+			bytes_read += l;
+			continue;
+		}
+		if (dst_bytes_remain < 65)
+			break;
+		memcpy(dst + dst_length, src + run_start, run_length);
+		dst_length += run_length;
+		run_length = 0;
+		donut_unpack_block(scratch_space, block);
+		dst_length += donut_pack_block(dst + dst_length, scratch_space, cpu_limit, NULL);
+		bytes_read += l;
+	}
+	memcpy(dst + dst_length, src + run_start, run_length);
+	dst_length += run_length;
+
+	if (src_bytes_read)
+		*src_bytes_read = bytes_read;
+	return dst_length;
+}
+
+bool donut_view_init(struct donut_view* view, const uint8_t* src, size_t src_length, int cache_size)
+{
+	memset(view, 0x00, sizeof(struct donut_view));
+	view->src = src;
+	view->src_length = src_length;
+	view->cache_size = (cache_size > 0) ? cache_size : 1;
+	view->most_recent = -1;
+	view->least_recent = -1;
+	view->block_capacity = 64;
+	view->block_offsets = malloc(sizeof(size_t) * (view->block_capacity + 1));
+	view->block_slots = malloc(sizeof(int) * view->block_capacity);
+	view->cache = malloc((size_t)view->cache_size * 64);
+	view->slot_blocks = malloc(sizeof(size_t) * view->cache_size);
+	view->slot_prev = malloc(sizeof(int) * view->cache_size);
+	view->slot_next = malloc(sizeof(int) * view->cache_size);
+	if (!view->block_offsets || !view->block_slots || !view->cache ||
+		!view->slot_blocks || !view->slot_prev || !view->slot_next) {
+		donut_view_free(view);
+		return false;
+	}
+	view->block_offsets[0] = 0;
+	return true;
+}
+
+void donut_view_free(struct donut_view* view)
+{
+	free(view->block_offsets);
+	free(view->block_slots);
+	free(view->cache);
+	free(view->slot_blocks);
+	free(view->slot_prev);
+	free(view->slot_next);
+	memset(view, 0x00, sizeof(struct donut_view));
+}
+
+// Scan forward from the last block found until 'block_index' is found.
+static bool donut_view_find_block(struct donut_view* view, size_t block_index)
+{
+	uint8_t scratch_space[74];
+	while (view->block_count <= block_index) {
+		size_t offset = view->block_offsets[view->block_count];
+		size_t src_bytes_remain = view->src_length - offset;
+		const uint8_t* block = view->src + offset;
+		if (src_bytes_remain == 0)
+			return false;
+		if (src_bytes_remain < 74) {
+			memset(scratch_space, 0x00, 74);
+			memcpy(scratch_space, block, src_bytes_remain);
+			block = scratch_space;
+		}
+		int l = donut_block_length(block);
+		if ((!l) || ((size_t)l > src_bytes_remain))
+			return false;
+		if (view->block_count >= view->block_capacity) {
+			size_t capacity = view->block_capacity * 2;
+			size_t* offsets = realloc(view->block_offsets, sizeof(size_t) * (capacity + 1));
+			if (!offsets)
+				return false;
+			view->block_offsets = offsets;
+			int* slots = realloc(view->block_slots, sizeof(int) * capacity);
+			if (!slots)
+				return false;
+			view->block_slots = slots;
+			view->block_capacity = capacity;
+		}
+		view->block_slots[view->block_count] = -1;
+		view->block_offsets[view->block_count + 1] = offset + l;
+		++view->block_count;
+	}
+	return true;
+}
+
+static void donut_view_unlink_slot(struct donut_view* view, int slot)
+{
+	if (view->slot_prev[slot] >= 0)
+		view->slot_next[view->slot_prev[slot]] = view->slot_next[slot];
+	else
+		view->most_recent = view->slot_next[slot];
+	if (view->slot_next[slot] >= 0)
+		view->slot_prev[view->slot_next[slot]] = view->slot_prev[slot];
+	else
+		view->least_recent = view->slot_prev[slot];
+}
+
+static void donut_view_link_slot(struct donut_view* view, int slot)
+{
+	view->slot_prev[slot] = -1;
+	view->slot_next[slot] = view->most_recent;
+	if (view->most_recent >= 0)
+		view->slot_prev[view->most_recent] = slot;
+	else
+		view->least_recent = slot;
+	view->most_recent = slot;
+}
+
+const uint8_t* donut_view_block(struct donut_view* view, size_t block_index)
+{
+	uint8_t scratch_space[74];
+	if (!donut_view_find_block(view, block_index))
+		return NULL;
+	int slot = view->block_slots[block_index];
+	if (slot >= 0) {
+		if (slot != view->most_recent) {
+			donut_view_unlink_slot(view, slot);
+			donut_view_link_slot(view, slot);
+		}
+		return view->cache + (size_t)slot*64;
+	}
+
+	if (view->cache_used < view->cache_size) {
+		slot = view->cache_used;
+		++view->cache_used;
+	} else {
+		slot = view->least_recent;
+		view->block_slots[view->slot_blocks[slot]] = -1;
+		donut_view_unlink_slot(view, slot);
+	}
+	size_t offset = view->block_offsets[block_index];
+	size_t l = view->block_offsets[block_index + 1] - offset;
+	const uint8_t* block = view->src + offset;
+	if (view->src_length - offset < 74) {
+		// the block fits, but donut_unpack_block() may read past it
+		memset(scratch_space, 0x00, 74);
+		memcpy(scratch_space, block, l);
+		block = scratch_space;
+	}
+	donut_unpack_block(view->cache + (size_t)slot*64, block);
+	view->slot_blocks[slot] = block_index;
+	view->block_slots[block_index] = slot;
+	donut_view_link_slot(view, slot);
+	return view->cache + (size_t)slot*64;
+}
+
+const uint8_t* donut_view_tile(struct donut_view* view, size_t tile_index)
+{
+	const uint8_t* block = donut_view_block(view, tile_index / 4);
+	return (block) ? (block + (tile_index % 4)*16) : NULL;
+}
+
+int donut_decompress(uint8_t* dst, int dst_capacity, const uint8_t* src, int src_length, int* src_bytes_read)
+{
+	size_t bytes_read = 0;
+	size_t dst_length = 0;
+	if ((dst_capacity > 0) && (src_length > 0))
+		dst_length = donut_decompress_large(dst, dst_capacity, src, src_length, &bytes_read);
+	if (src_bytes_read)
+		*src_bytes_read = (int)bytes_read;
+	return (int)dst_length;
+}
+
+int donut_compress(uint8_t* dst, int dst_capacity, const uint8_t* src, int src_length, int* src_bytes_read)
+{
+	size_t bytes_read = 0;
+	size_t dst_length = 0;
+	if ((dst_capacity > 0) && (src_length > 0))
+		dst_length = donut_compress_large(dst, dst_capacity, src, src_length, &bytes_read);
+	if (src_bytes_read)
+		*src_bytes_read = (int)bytes_read;
+	return (int)dst_length;
+}
+
+static int donut_group_score(const uint8_t* src, const int* tiles, int count, int cpu_limit, bool least_cycles)
+{
+	uint8_t block[64];
+	uint8_t cblock[65];
+	int i;
+	// tiles not chosen yet are left as 0x00
+	memset(block, 0x00, 64);
+	for (i = 0; i < count; ++i) {
+		memcpy(block + i*16, src + tiles[i]*16, 16);
+	}
+	int len = donut_pack_block(cblock, block, cpu_limit, NULL);
+	int cycles = donut_block_runtime_cost(cblock, len);
+	return (least_cycles) ? ((cycles << 7) + len) : ((len << 16) + cycles);
+}
+
+static void donut_swap_tiles(int* tile_order, int a, int b)
+{
+	int t = tile_order[a];
+	tile_order[a] = tile_order[b];
+	tile_order[b] = t;
+}
+
+void donut_group_tiles(int* tile_order, const uint8_t* src, int tile_count, int cpu_limit, bool least_cycles)
+{
+	int i, j, k, b1, b2, pass;
+	uint64_t file_order_score = 0;
+	uint64_t greedy_score = 0;
+	for (i = 0; i < tile_count; ++i) {
+		tile_order[i] = i;
+	}
+	tile_count &= ~3;
+	for (i = 0; i < tile_count; i += 4) {
+		file_order_score += donut_group_score(src, tile_order + i, 4, cpu_limit, least_cycles);
+	}
+
+	// Greedy: starting with the next tile in file order, fill each block
+	// with whichever of the following tiles packs best with it.
+	for (i = 0; i < tile_count; i += 4) {
+		for (j = i + 1; j < i + 4; ++j) {
+			int best = j;
+			int best_score = -1;
+			for (k = j; (k < tile_count) && (k < j + DONUT_GROUP_WINDOW); ++k) {
+				donut_swap_tiles(tile_order, j, k);
+				int score = donut_group_score(src, tile_order + i, j - i + 1, cpu_limit, least_cycles);
+				donut_swap_tiles(tile_order, j, k);
+				if ((best_score < 0) || (score < best_score)) {
+					best_score = score;
+					best = k;
+				}
+			}
+			donut_swap_tiles(tile_order, j, best);
+		}
+		greedy_score += donut_group_score(src, tile_order + i, 4, cpu_limit, least_cycles);
+	}
+	// the greedy choices can miss what the original order got right
+	if (greedy_score > file_order_score) {
+		for (i = 0; i < tile_count; ++i) {
+			tile_order[i] = i;
+		}
+	}
+
+	// Local search: swap tiles between nearby blocks while that
+	// makes the pair of blocks better.
+	for (pass = 0; pass < DONUT_GROUP_PASSES; ++pass) {
+		bool improved = false;
+		for (b1 = 0; b1 < tile_count; b1 += 4) {
+			for (b2 = b1 + 4; (b2 < tile_count) && (b2 < b1 + DONUT_GROUP_WINDOW); b2 += 4) {
+				int score = donut_group_score(src, tile_order + b1, 4, cpu_limit, least_cycles)
+					+ donut_group_score(src, tile_order + b2, 4, cpu_limit, least_cycles);
+				for (j = b1; j < b1 + 4; ++j) {
+					for (k = b2; k < b2 + 4; ++k) {
+						donut_swap_tiles(tile_order, j, k);
+						int new_score = donut_group_score(src, tile_order + b1, 4, cpu_limit, least_cycles)
+							+ donut_group_score(src, tile_order + b2, 4, cpu_limit, least_cycles);
+						if (new_score < score) {
+							score = new_score;
+							improved = true;
+						} else {
+							donut_swap_tiles(tile_order, j, k);
+						}
+					}
+				}
+			}
+		}
+		if (!improved)
+			break;
+	}
+}
+
 #endif // DONUT_NES_IMPLEMENTATION
 #endif // INCLUDE_DONUT_NES_H